@@ -0,0 +1,532 @@
+// Joust Test Suite			-*- mode:c++ -*-
+// Copyright (C) 2020-2024 Nathan Sidwell, nathan@acm.org
+// License: Affero GPL v3.0
+
+#include "joust/cfg.h"
+// Gaige
+#include "gaige/logz.hh"
+// C++
+#include <algorithm>
+#include <vector>
+// C
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+// OS
+#include <sys/stat.h>
+#include <unistd.h>
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace gaige;
+
+namespace {
+
+// File layout, integers are little-endian
+constexpr std::string_view logMagic = "ALOYLZ1\n";
+constexpr std::string_view indexMagic = "ALOYLZX1";
+constexpr std::string_view frameMagic = "ALZF";
+// A frame: frameMagic, u32 NAMELEN, NAME, then blocks, each u8 CODEC,
+// u32 RAWLEN, u32 PACKEDLEN, PACKED.  An empty block ends it.
+constexpr size_t frameHead = 8;
+constexpr size_t blockHead = 9;
+// The index: indexMagic, u64 SLOTS (a power of 2), then each slot
+// u64 HASH, u64 FRAME (0 if empty).
+constexpr size_t slotSize = 16;
+
+enum Codecs : unsigned char { STORED, LZ77, ZSTD };
+
+void put (std::string &out, uint64_t value, unsigned bytes) {
+  for (; bytes--; value >>= 8)
+    out.push_back(char(value & 0xff));
+}
+
+uint64_t get (char const *in, unsigned bytes) {
+  uint64_t value = 0;
+  for (unsigned ix = bytes; ix--;)
+    value = value << 8 | (unsigned char)in[ix];
+  return value;
+}
+
+// FNV-1a, never zero
+
+uint64_t hashName (std::string_view name) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (char c : name)
+    hash = (hash ^ (unsigned char)c) * 0x100000001b3ull;
+  return hash ? hash : 1;
+}
+
+int readAll (int fd, off_t pos, char *buffer, size_t len) {
+  while (len) {
+    ssize_t got = pread(fd, buffer, len, pos);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return got < 0 ? errno : EBADMSG;
+    buffer += got;
+    pos += got;
+    len -= got;
+  }
+  return 0;
+}
+
+void putVarint (std::string &out, size_t value) {
+  for (; value >= 0x80; value >>= 7)
+    out.push_back(char(value | 0x80));
+  out.push_back(char(value));
+}
+
+bool getVarint (unsigned char const *&in, unsigned char const *end,
+                size_t &value) {
+  value = 0;
+  for (unsigned shift = 0; in != end && shift < 64; shift += 7) {
+    unsigned char byte = *in++;
+    value |= size_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+// A greedy LZ77: runs of 'LITLEN LITERALS MATCHLEN-4 DISTANCE', the
+// last without a match.  Lengths are varints.  Log text is
+// repetitive enough for this to do well.
+
+void lzPack (std::string_view text, std::string &out) {
+  constexpr unsigned hashBits = 16;
+  std::vector<uint32_t> recent(1u << hashBits, ~0u);
+  auto word = [&] (size_t pos) {
+    uint32_t value;
+    memcpy(&value, text.data() + pos, 4);
+    return value;
+  };
+
+  size_t anchor = 0;
+  for (size_t pos = 0; pos + 4 <= text.size();) {
+    uint32_t here = word(pos);
+    uint32_t &slot = recent[(here * 2654435761u) >> (32 - hashBits)];
+    size_t prev = slot;
+    slot = pos;
+    if (prev == ~0u || word(prev) != here) {
+      pos++;
+      continue;
+    }
+
+    size_t len = 4;
+    while (pos + len != text.size() && text[prev + len] == text[pos + len])
+      len++;
+    putVarint(out, pos - anchor);
+    out.append(text.substr(anchor, pos - anchor));
+    putVarint(out, len - 4);
+    putVarint(out, pos - prev);
+    pos += len;
+    anchor = pos;
+  }
+  putVarint(out, text.size() - anchor);
+  out.append(text.substr(anchor));
+}
+
+bool lzUnpack (std::string_view packed, size_t raw, std::string &out) {
+  size_t base = out.size();
+  auto in = reinterpret_cast<unsigned char const *>(packed.data());
+  auto end = in + packed.size();
+  for (;;) {
+    size_t lits;
+    if (!getVarint(in, end, lits) || size_t(end - in) < lits
+        || out.size() - base + lits > raw)
+      return false;
+    out.append(reinterpret_cast<char const *>(in), lits);
+    in += lits;
+    if (in == end)
+      break;
+
+    size_t len, distance;
+    if (!getVarint(in, end, len) || !getVarint(in, end, distance))
+      return false;
+    len += 4;
+    size_t have = out.size() - base;
+    if (!distance || distance > have || have + len > raw)
+      return false;
+    for (size_t from = out.size() - distance; len--;)
+      out.push_back(out[from++]);
+  }
+
+  return out.size() - base == raw;
+}
+
+// Append the block of TEXT, packed if that's smaller
+
+void packBlock (std::string_view text, std::string &out) {
+  size_t head = out.size();
+  put(out, STORED, 1);
+  put(out, text.size(), 4);
+  put(out, 0, 4);
+  size_t base = out.size();
+
+  Codecs codec = LZ77;
+#if HAVE_ZSTD
+  size_t bound = ZSTD_compressBound(text.size());
+  out.resize(base + bound);
+  size_t len = ZSTD_compress(out.data() + base, bound, text.data(),
+                             text.size(), 3);
+  if (ZSTD_isError(len))
+    out.resize(base);
+  else {
+    out.resize(base + len);
+    codec = ZSTD;
+  }
+  if (codec != ZSTD)
+#endif
+    lzPack(text, out);
+
+  if (out.size() - base >= text.size()) {
+    out.resize(base);
+    out.append(text);
+    codec = STORED;
+  }
+  out[head] = char(codec);
+  std::string packed;
+  put(packed, out.size() - base, 4);
+  out.replace(head + 5, 4, packed);
+}
+
+bool unpackBlock (Codecs codec, std::string_view packed, size_t raw,
+                  std::string &out) {
+  switch (codec) {
+  case STORED:
+    if (packed.size() != raw)
+      return false;
+    out.append(packed);
+    return true;
+
+  case LZ77:
+    out.reserve(out.size() + raw);
+    return lzUnpack(packed, raw, out);
+
+  case ZSTD:
+#if HAVE_ZSTD
+  {
+    size_t base = out.size();
+    out.resize(base + raw);
+    size_t len = ZSTD_decompress(out.data() + base, raw, packed.data(),
+                                 packed.size());
+    return !ZSTD_isError(len) && len == raw;
+  }
+#endif
+    break;
+  }
+
+  return false;
+}
+
+// Read the frame at POS of FD, giving its NAME, RAW text length, and
+// END.  If TEXT, append its text.  Return errno, -1 at the end of the
+// file.
+
+int readFrame (int fd, off_t pos, std::string &name, size_t &raw,
+               std::string *text, off_t &end) {
+  char head[std::max(frameHead, blockHead)];
+  ssize_t got = pread(fd, head, frameHead, pos);
+  if (!got)
+    return -1;
+  if (got != ssize_t(frameHead) || frameMagic != std::string_view(head, 4))
+    return got < 0 ? errno : EBADMSG;
+
+  size_t name_len = get(head + 4, 4);
+  if (name_len > 4096)
+    // Not a test name
+    return EBADMSG;
+  name.resize(name_len);
+  pos += frameHead;
+  if (int err = readAll(fd, pos, name.data(), name.size()))
+    return err;
+  pos += name.size();
+
+  raw = 0;
+  std::string packed;
+  for (;;) {
+    if (int err = readAll(fd, pos, head, blockHead))
+      return err;
+    pos += blockHead;
+    size_t block_raw = get(head + 1, 4);
+    size_t block_packed = get(head + 5, 4);
+    if (!block_raw)
+      break;
+    if (block_raw > LogPacker::BlockSize
+        || block_packed > block_raw + block_raw / 2 + 64)
+      return EBADMSG;
+
+    if (text) {
+      packed.resize(block_packed);
+      if (int err = readAll(fd, pos, packed.data(), packed.size()))
+        return err;
+      if (!unpackBlock(Codecs(head[0]), packed, block_raw, *text))
+        return EBADMSG;
+    }
+    pos += block_packed;
+    raw += block_raw;
+  }
+  end = pos;
+
+  return 0;
+}
+
+// Append the text of TEST's frame in FD, reading them all.  The last
+// is the latest.  A run that didn't finish may have left part of a
+// frame.
+
+int scanTest (int fd, std::string_view test, std::string &text) {
+  std::string name;
+  size_t raw;
+  off_t end;
+  off_t found = 0;
+  for (off_t pos = logMagic.size();; pos = end) {
+    int err = readFrame(fd, pos, name, raw, nullptr, end);
+    if (err == EBADMSG || err < 0)
+      break;
+    if (err)
+      return err;
+    if (name == test)
+      found = pos;
+  }
+  if (!found)
+    return ENOENT;
+
+  return readFrame(fd, found, name, raw, &text, end);
+}
+
+// Append the text of TEST's frame in FD, found via the index IDX_FD
+
+int findTest (int fd, int idx_fd, std::string_view test, std::string &text) {
+  std::string name;
+  size_t raw;
+  off_t end;
+  char head[indexMagic.size() + 8];
+  if (int err = readAll(idx_fd, 0, head, sizeof(head)))
+    return err;
+  uint64_t slots = get(head + indexMagic.size(), 8);
+  if (indexMagic != std::string_view(head, indexMagic.size()) || !slots
+      || slots & (slots - 1))
+    return EBADMSG;
+
+  uint64_t hash = hashName(test);
+  for (uint64_t probe = 0; probe != slots; probe++) {
+    char slot[slotSize];
+    uint64_t ix = (hash + probe) & (slots - 1);
+    if (int err = readAll(idx_fd, sizeof(head) + ix * slotSize, slot,
+                          slotSize))
+      return err;
+    uint64_t frame = get(slot + 8, 8);
+    if (!frame)
+      break;
+    if (get(slot, 8) != hash)
+      continue;
+    if (int err = readFrame(fd, frame, name, raw, nullptr, end))
+      return err < 0 ? EBADMSG : err;
+    if (name == test) {
+      int err = readFrame(fd, frame, name, raw, &text, end);
+      return err < 0 ? EBADMSG : err;
+    }
+  }
+
+  return ENOENT;
+}
+
+} // namespace
+
+int LogPacker::open (int fd, size_t raw) {
+  FD = fd;
+  struct stat stat;
+  if (fstat(FD, &stat) < 0)
+    return errno;
+  if (!stat.st_size || !raw) {
+    if (ftruncate(FD, 0) < 0)
+      return errno;
+    return emit(std::string(logMagic));
+  }
+
+  // Keep the frames of the first RAW bytes
+  char magic[logMagic.size()];
+  if (int err = readAll(FD, 0, magic, sizeof(magic)))
+    return err;
+  if (logMagic != std::string_view(magic, sizeof(magic)))
+    return EBADMSG;
+  off_t pos = sizeof(magic);
+  while (Raw != raw) {
+    std::string name;
+    size_t len;
+    off_t end;
+    if (int err = readFrame(FD, pos, name, len, nullptr, end))
+      return err < 0 ? EBADMSG : err;
+    if (!name.empty())
+      Frames[name] = pos;
+    Raw += len;
+    pos = end;
+    if (Raw > raw)
+      return EBADMSG;
+  }
+  if (ftruncate(FD, pos) < 0)
+    return errno;
+  Size = pos;
+
+  return 0;
+}
+
+int LogPacker::emit (std::string const &bytes) {
+  for (size_t done = 0; done != bytes.size();) {
+    ssize_t wrote
+        = pwrite(FD, bytes.data() + done, bytes.size() - done, Size + done);
+    if (wrote < 0) {
+      if (errno != EINTR)
+        return errno;
+    } else
+      done += wrote;
+  }
+  Size += bytes.size();
+
+  return 0;
+}
+
+// Write the pending text as a block, starting the frame if need be
+
+int LogPacker::block () {
+  std::string out;
+  if (Frame < 0) {
+    Frame = Size;
+    out.append(frameMagic);
+    put(out, Name.size(), 4);
+    out.append(Name);
+  }
+  if (!Text.empty())
+    packBlock(Text, out);
+  Text.clear();
+
+  return emit(out);
+}
+
+int LogPacker::frame (std::string_view test) {
+  int err = 0;
+  if (!Text.empty())
+    err = block();
+  if (Frame >= 0) {
+    std::string out;
+    put(out, STORED, 1);
+    put(out, 0, 8);
+    if (!err)
+      err = emit(out);
+    if (!Name.empty())
+      Frames[Name] = Frame;
+  }
+  Frame = -1;
+  Name = test;
+
+  return err;
+}
+
+int LogPacker::append (char const *text, size_t len) {
+  Raw += len;
+  while (len) {
+    size_t room = std::min(len, BlockSize - Text.size());
+    Text.append(text, room);
+    text += room;
+    len -= room;
+    if (Text.size() == BlockSize)
+      if (int err = block())
+        return err;
+  }
+
+  return 0;
+}
+
+int LogPacker::copy (int from, size_t len) {
+  std::vector<char> buffer(std::min(len, BlockSize));
+  for (off_t pos = 0; len;) {
+    size_t chunk = std::min(len, buffer.size());
+    if (int err = readAll(from, pos, buffer.data(), chunk))
+      return err;
+    if (int err = append(buffer.data(), chunk))
+      return err;
+    pos += chunk;
+    len -= chunk;
+  }
+
+  return 0;
+}
+
+// An open addressed table, at most half full
+
+int LogPacker::writeIndex (int fd) const {
+  size_t slots = 16;
+  while (slots < Frames.size() * 2)
+    slots *= 2;
+  std::vector<std::pair<uint64_t, uint64_t>> table(slots);
+  for (auto const &[name, frame] : Frames) {
+    uint64_t hash = hashName(name);
+    size_t ix = hash & (slots - 1);
+    while (table[ix].second)
+      ix = (ix + 1) & (slots - 1);
+    table[ix] = {hash, frame};
+  }
+
+  std::string out(indexMagic);
+  put(out, slots, 8);
+  for (auto const &[hash, frame] : table) {
+    put(out, hash, 8);
+    put(out, frame, 8);
+  }
+  for (size_t done = 0; done != out.size();) {
+    ssize_t wrote = write(fd, out.data() + done, out.size() - done);
+    if (wrote < 0) {
+      if (errno != EINTR)
+        return errno;
+    } else
+      done += wrote;
+  }
+
+  return 0;
+}
+
+int gaige::unpackTest (int fd, int idx_fd, std::string_view test,
+                       std::string &text) {
+  if (idx_fd >= 0) {
+    size_t size = text.size();
+    int err = findTest(fd, idx_fd, test, text);
+    if (err != EBADMSG && err != ENOENT)
+      return err;
+    // A stale index, left by a run that didn't write its own, may not
+    // describe this log
+    text.resize(size);
+  }
+
+  return scanTest(fd, test, text);
+}
+
+int gaige::indexLog (int fd,
+                     std::vector<std::pair<std::string, off_t>> &frames) {
+  char magic[logMagic.size()];
+  if (int err = readAll(fd, 0, magic, sizeof(magic)))
+    return err;
+  if (logMagic != std::string_view(magic, sizeof(magic)))
+    return EBADMSG;
+
+  std::string name;
+  size_t raw;
+  off_t end;
+  for (off_t pos = sizeof(magic);; pos = end) {
+    if (int err = readFrame(fd, pos, name, raw, nullptr, end))
+      return err < 0 ? 0 : err;
+    if (!name.empty())
+      frames.emplace_back(name, pos);
+  }
+}
+
+int gaige::unpackFrame (int fd, off_t frame, std::string &text) {
+  std::string name;
+  size_t raw;
+  off_t end;
+  int err = readFrame(fd, frame, name, raw, &text, end);
+
+  return err < 0 ? EBADMSG : err;
+}
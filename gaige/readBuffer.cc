@@ -7,6 +7,7 @@
 #include "nms/fatal.hh"
 // Gaige
 #include "gaige/readBuffer.hh"
+#include "gaige/spawn.hh"
 // C
 #include <cerrno>
 // OS
@@ -14,6 +15,11 @@
 
 using namespace gaige;
 
+ReadBuffer::~ReadBuffer () {
+  if (SpillFD >= 0)
+    ::close(SpillFD);
+}
+
 int ReadBuffer::read () {
   assert(FD >= 0);
 
@@ -31,5 +37,56 @@ int ReadBuffer::read () {
   if (count < 0 && errno != EINTR)
     res = errno;
 
+  if (Cap)
+    // On failure the text stays in memory, and spillError says why
+    spill();
+
   return res;
 }
+
+int ReadBuffer::spill () {
+  if (SpillError)
+    // We've stopped
+    return 0;
+  if (SpillFD < 0) {
+    if (!Cap || size() <= Cap)
+      return 0;
+    SpillFD = makeTemp("spill");
+    if (SpillFD < 0) {
+      Cap = 0;
+      SpillError = errno;
+      return SpillError;
+    }
+  }
+
+  size_t done = 0;
+  while (done != size()) {
+    ssize_t wrote = ::write(SpillFD, data() + done, size() - done);
+    if (wrote < 0) {
+      if (errno == EINTR)
+        continue;
+      // Keep the remainder in memory
+      int err = errno;
+      Spilled += done;
+      erase(begin(), begin() + done);
+      Cap = 0;
+      SpillError = err;
+      return err;
+    }
+    done += wrote;
+  }
+  Spilled += done;
+  clear();
+
+  return 0;
+}
+
+void ReadBuffer::release () {
+  if (SpillFD >= 0)
+    ::close(SpillFD);
+  SpillFD = -1;
+  Spilled = 0;
+  SpillError = 0;
+  clear();
+  shrink_to_fit();
+}
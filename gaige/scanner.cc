@@ -39,6 +39,11 @@ bool Scanner::scanFile (std::string const &fname,
   }(fd);
   if (len == ~size_t(0))
     goto fatal;
+  if (!len) {
+    // Nothing to map, nor scan
+    close(fd);
+    return false;
+  }
 
   size_t page_size = sysconf(_SC_PAGE_SIZE);
   size_t alloc = (len + page_size) & ~(page_size - 1);
@@ -7,9 +7,18 @@
 #include "nms/fatal.hh"
 // Gaige
 #include "gaige/spawn.hh"
+// C++
+#include <algorithm>
+#include <string>
+// C
+#include <cerrno>
+#include <cstdlib>
 // OS
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <unistd.h>
 
@@ -19,7 +28,8 @@ using namespace gaige;
 std::tuple<pid_t, int> gaige::spawn (int fd_in, int fd_out, int fd_err,
                                      std::vector<std::string> const &command,
                                      std::vector<std::string> const *wrapper,
-                                     unsigned const *limits) {
+                                     unsigned const *limits, int cgroup,
+                                     bool group) {
   std::tuple<pid_t, int> res{0, 0};
   auto &[pid, err] = res;
   int pipe_fds[2];
@@ -35,6 +45,13 @@ std::tuple<pid_t, int> gaige::spawn (int fd_in, int fd_out, int fd_err,
       // Child
       close(pipe_fds[0]);
 
+      // The parent's blocked signals are its own business
+      sigset_t mask;
+      sigemptyset(&mask);
+      sigprocmask(SIG_SETMASK, &mask, nullptr);
+      if (group)
+        setpgid(0, 0);
+
       // Count the arguments
       unsigned nargs = command.size();
       if (wrapper)
@@ -54,6 +71,13 @@ std::tuple<pid_t, int> gaige::spawn (int fd_in, int fd_out, int fd_err,
       if ((fd_in == 0 || dup2(fd_in, 0) >= 0)
           && (fd_out == 1 || dup2(fd_out, 1) >= 0)
           && (fd_err == 2 || dup2(fd_err, 2) >= 0)) {
+        if (cgroup >= 0) {
+          // Writing 0 moves ourselves, and thus our descendants
+          int procs = openat(cgroup, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+          if (procs < 0 || write(procs, "0", 1) != 1)
+            goto failed;
+          close(procs);
+        }
         if (limits) {
           // If limit setting fails, do not exec
           for (unsigned jx = PL_HWM; jx--;)
@@ -90,8 +114,13 @@ std::tuple<pid_t, int> gaige::spawn (int fd_in, int fd_out, int fd_err,
 
     if (pid < 0)
       pid = 0;
-    else if (!read(pipe_fds[0], &err, sizeof(err)))
-      err = 0;
+    else {
+      // Either of us might get there first
+      if (group)
+        setpgid(pid, pid);
+      if (!read(pipe_fds[0], &err, sizeof(err)))
+        err = 0;
+    }
 
     close(pipe_fds[0]);
   }
@@ -106,6 +135,118 @@ std::tuple<pid_t, int> gaige::spawn (int fd_in, int fd_out, int fd_err,
   return res;
 }
 
+int gaige::makeTemp (char const *name [[maybe_unused]]) {
+#if HAVE_MEMFD_CREATE
+  return memfd_create(name, MFD_CLOEXEC);
+#else
+  char const *dir = getenv("TMPDIR");
+  if (!dir || !*dir)
+    dir = "/tmp";
+  std::string tmpl(dir);
+  tmpl.append("/joust-XXXXXX");
+
+  int fd = mkstemp(tmpl.data());
+  if (fd >= 0) {
+    // We only want the inode
+    unlink(tmpl.c_str());
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+#endif
+}
+
+int gaige::openPidFD (pid_t pid [[maybe_unused]]) {
+#if HAVE_PIDFD_OPEN
+  // glibc's wrapper is recent, use the syscall
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int gaige::copyFile (int from, int to, size_t len) {
+  off_t pos = 0;
+
+  // TO might be shared with an appending stream.  Not seekable is fine.
+  lseek(to, 0, SEEK_END);
+
+#if HAVE_COPY_FILE_RANGE
+  // File to file, possibly sharing extents
+  while (size_t(pos) != len) {
+    ssize_t done = copy_file_range(from, &pos, to, nullptr, len - pos, 0);
+    if (done > 0)
+      continue;
+    if (done < 0 && errno == EINTR)
+      continue;
+    if (done < 0 && errno != EXDEV && errno != EINVAL && errno != ENOSYS
+        && errno != EOPNOTSUPP && errno != EBADF)
+      return errno;
+    break;
+  }
+#endif
+#if HAVE_SPLICE
+  // File to pipe
+  while (size_t(pos) != len) {
+    ssize_t done = splice(from, &pos, to, nullptr, len - pos, 0);
+    if (done > 0)
+      continue;
+    if (done < 0 && errno == EINTR)
+      continue;
+    if (done < 0 && errno != EINVAL)
+      return errno;
+    break;
+  }
+#endif
+
+  // Anything else
+  char buffer[0x4000];
+  while (size_t(pos) != len) {
+    size_t limit = std::min(sizeof(buffer), len - pos);
+    ssize_t got = pread(from, buffer, limit, pos);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return got < 0 ? errno : EIO;
+    for (ssize_t done = 0; done != got;) {
+      ssize_t wrote = write(to, buffer + done, got - done);
+      if (wrote < 0) {
+        if (errno != EINTR)
+          return errno;
+      } else
+        done += wrote;
+    }
+    pos += got;
+  }
+
+  return 0;
+}
+
+int gaige::copyRange (int from, off_t from_pos, int to, off_t to_pos,
+                      size_t len) {
+  char buffer[0x4000];
+  while (len) {
+    ssize_t got = pread(from, buffer, std::min(sizeof(buffer), len), from_pos);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return got < 0 ? errno : EIO;
+    for (ssize_t done = 0; done != got;) {
+      ssize_t wrote = pwrite(to, buffer + done, got - done, to_pos + done);
+      if (wrote < 0) {
+        if (errno != EINTR)
+          return errno;
+      } else
+        done += wrote;
+    }
+    from_pos += got;
+    to_pos += got;
+    len -= got;
+  }
+
+  return 0;
+}
+
 #ifndef HAVE_PIPE2
 int gaige::makePipe (int pipes[2]) {
   if (pipe(pipes) < 0)
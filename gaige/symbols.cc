@@ -21,10 +21,30 @@ using namespace gaige;
 std::string const *Symbols::value (std::string const &var) const {
   auto iter = Table.find(var);
 
-  return iter == Table.end() ? nullptr : &iter->second;
+  if (iter != Table.end())
+    return &iter->second;
+
+  return Outer ? Outer->value(var) : nullptr;
+}
+
+std::vector<std::pair<std::string_view, std::string_view>>
+Symbols::definitions () const {
+  std::vector<std::pair<std::string_view, std::string_view>> defs;
+  if (Outer)
+    defs = Outer->definitions();
+  for (auto const &[var, val] : Table)
+    if (!(Outer && Outer->value(var)))
+      defs.emplace_back(var, val);
+  std::sort(defs.begin(), defs.end());
+
+  return defs;
 }
 
+// First definition wins, including one in an outer scope
 bool Symbols::value (std::string_view const &var, std::string_view const &v) {
+  if (Outer && Outer->value(std::string(var)))
+    return false;
+
   auto [iter, inserted] = Table.emplace(var, v);
   return inserted;
 }
@@ -43,6 +43,8 @@ public:
 
 public:
   static bool hasErrored () { return HasErrored; }
+  // Forget earlier errors, for processing another independent input
+  static void resetErrored () { HasErrored = false; }
 };
 
 } // namespace gaige
@@ -0,0 +1,85 @@
+// Joust Test Suite			-*- mode:c++ -*-
+// Copyright (C) 2020-2024 Nathan Sidwell, nathan@acm.org
+// License: Affero GPL v3.0
+
+#ifndef GAIGE_LOGZ_HH
+
+// C++
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+// OS
+#include <unistd.h>
+
+namespace gaige {
+
+// Compressed logs.  The file is a header, then a frame per test (and
+// others for any text between them).  A frame is its test's name,
+// and blocks of up to BlockSize bytes of text, each compressed on its
+// own (with zstd, or a built-in LZ77 codec), ending with an empty
+// one.  An index file maps test names to their frames, as a hash
+// table, so one test's log can be found without reading the others.
+class LogPacker {
+public:
+  static constexpr size_t BlockSize = 1 << 20;
+
+private:
+  int FD = -1;
+  off_t Size = 0;        // Of the file
+  size_t Raw = 0;        // Text, in all frames
+  off_t Frame = -1;      // Start of the current frame, once written
+  std::string Name;      // The current frame's
+  std::string Text;      // Its pending block
+  std::unordered_map<std::string, off_t> Frames; // Of each test
+
+public:
+  LogPacker () = default;
+
+private:
+  LogPacker (LogPacker const &) = delete;
+  LogPacker &operator= (LogPacker const &) = delete;
+
+public:
+  bool isOpen () const { return FD >= 0; }
+  // Text written so far
+  size_t raw () const { return Raw; }
+
+public:
+  // Write to FD.  If that has a previous run's frames, keep those
+  // holding the first RAW bytes of text, and add to them.  Return
+  // errno or 0.
+  int open (int fd, size_t raw = 0);
+  // Finish the current frame, and start one for TEST (or none)
+  int frame (std::string_view test);
+  int append (char const *text, size_t len);
+  // Append LEN bytes from the start of file FROM
+  int copy (int from, size_t len);
+  // Finish the current frame
+  int close () { return frame(std::string_view()); }
+  // Write the index to FD
+  int writeIndex (int fd) const;
+
+private:
+  int block ();
+  int emit (std::string const &bytes);
+};
+
+// Append the text of TEST's frame in the compressed log FD, found via
+// the index IDX_FD, or by reading the frames if that's -1 or the index
+// is unusable or lacks it.  Return errno, ENOENT if it's not there.
+int unpackTest (int fd, int idx_fd, std::string_view test, std::string &text);
+
+// Append the name and offset of each of the compressed log FD's test
+// frames to FRAMES, in order.  Return errno.
+int indexLog (int fd, std::vector<std::pair<std::string, off_t>> &frames);
+
+// Append the text of the frame at FRAME of the compressed log FD.
+// Return errno.
+int unpackFrame (int fd, off_t frame, std::string &text);
+
+} // namespace gaige
+
+#define GAIGE_LOGZ_HH
+#endif
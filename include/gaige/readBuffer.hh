@@ -17,6 +17,18 @@ private:
 
 private:
   int FD = -1;
+  int SpillFD = -1;  // Overflow file
+  size_t Spilled = 0; // Bytes in SpillFD, which precede ours
+  size_t Cap = 0;     // Bytes to hold in memory, zero for unlimited
+  int SpillError = 0; // Why spilling stopped, the rest is in memory
+
+public:
+  ReadBuffer () = default;
+  ~ReadBuffer ();
+
+private:
+  ReadBuffer (ReadBuffer const &) = delete;
+  ReadBuffer &operator= (ReadBuffer const &) = delete;
 
 public:
   // Read from fd, return errno on error, -1 on eof, 0 otherwise
@@ -28,13 +40,32 @@ public:
 public:
   int fd () const { return FD; }
 
-  void open (int f) { FD = f; }
+  void open (int f, size_t cap = 0) {
+    FD = f;
+    Cap = cap;
+  }
+
+  void cap (size_t c) { Cap = c; }
 
   int close () {
     int f = FD;
     FD = -1;
     return f;
   }
+
+public:
+  // Once over the cap, move the text to the spill file, and keep
+  // doing so.  Returns errno on error, when we stop spilling.
+  int spill ();
+  // Errno, if spilling stopped
+  int spillError () const { return SpillError; }
+  bool isSpilled () const { return SpillFD >= 0; }
+  int spillFD () const { return SpillFD; }
+  size_t spilled () const { return Spilled; }
+
+public:
+  // Discard the text, in memory and spilled
+  void release ();
 };
 
 } // namespace gaige
@@ -16,15 +16,33 @@ namespace gaige {
 
 enum ProcLimits { PL_CPU, PL_MEM, PL_FILE, PL_HWM };
 
-// Return pid_t & errno
+// Return pid_t & errno.  If CGROUP is a cgroup v2 directory fd, the
+// child moves itself into it before exec.  If GROUP, the child leads
+// a new process group.
 std::tuple<pid_t, int> spawn (int fd_in, int fd_out, int fd_err,
                               std::vector<std::string> const &words,
                               std::vector<std::string> const *wrapper
                               = nullptr,
-                              unsigned const *limits = nullptr);
+                              unsigned const *limits = nullptr,
+                              int cgroup = -1, bool group = false);
 
 int makePipe (int pipes[2]);
 
+// An anonymous, unlinked, read-write file.  Return fd or -1.
+int makeTemp (char const *name);
+
+// A pollable fd that becomes readable when child PID exits.  Return
+// fd or -1.
+int openPidFD (pid_t pid);
+
+// Copy LEN bytes from the start of file FROM to the end of TO,
+// without passing through userspace if we can.  Return errno or 0.
+int copyFile (int from, int to, size_t len);
+
+// Copy LEN bytes at FROM_POS of file FROM to TO_POS of file TO,
+// leaving both file offsets alone.  Return errno or 0.
+int copyRange (int from, off_t from_pos, int to, off_t to_pos, size_t len);
+
 // We always want cloexec pipes, and pipe2 is linux-specific
 #ifdef HAVE_PIPE2
 inline int makePipe (int pipes[2]) { return pipe2(pipes, O_CLOEXEC); }
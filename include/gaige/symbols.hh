@@ -8,16 +8,21 @@
 #include <string>
 #include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <variant>
+#include <vector>
 
 namespace gaige {
 
 class Symbols {
 private:
   std::unordered_map<std::string, std::string> Table;
+  Symbols const *Outer = nullptr; // Enclosing scope, consulted second
 
 public:
   Symbols () = default;
+  Symbols (Symbols const *outer)
+    : Outer(outer) {}
   ~Symbols () = default;
 
 private:
@@ -26,6 +31,9 @@ private:
 
 public:
   std::string const *value (std::string const &var) const;
+  // All definitions, sorted by name
+  std::vector<std::pair<std::string_view, std::string_view>>
+  definitions () const;
 
 public:
   bool value (std::string_view const &var, std::string_view const &val);
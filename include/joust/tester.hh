@@ -43,7 +43,9 @@ private:
   };
 
 public:
-#define JOUST_STATUSES PASS, FAIL, XPASS, XFAIL, ERROR, UNSUPPORTED, MSG
+// Later additions follow MSG, so the original values are unchanged
+#define JOUST_STATUSES \
+  PASS, FAIL, XPASS, XFAIL, ERROR, UNSUPPORTED, MSG, CACHED, FLAKY
   enum Statuses {
     NMS_LIST(NMS_IDENT, JOUST_STATUSES),
     STATUS_HWM,
@@ -87,8 +89,12 @@ public:
     return Statuses((pass ? PASS : FAIL) + (xfail ? XPASS - PASS : 0));
   }
 
-protected:
-  Statuses decodeStatus (std::string_view const &) noexcept;
+public:
+  static Statuses decodeStatus (std::string_view const &) noexcept;
+  // Whether a summary counts it, it does all but MSG
+  static bool isCounted (Statuses st) noexcept {
+    return st < STATUS_HWM && st != STATUS_REPORT;
+  }
 
 public:
   Streamer result (Statuses status, char const *filename) noexcept {
@@ -13,29 +13,54 @@
 // Gaige
 #include "gaige/error.hh"
 #include "gaige/lexer.hh"
+#include "gaige/logz.hh"
 #include "gaige/readBuffer.hh"
+#include "gaige/regex.hh"
+#include "gaige/scanner.hh"
 #include "gaige/spawn.hh"
 // Joust
 #include "joust/tester.hh"
 // C++
 #include <algorithm>
+#include <condition_variable>
 #include <deque>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <regex>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 // C
+#include <cstdio>
 #include <cstring>
 // OS
+#include <dirent.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <sys/fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 #ifdef USE_EPOLL
 #include <sys/epoll.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #else
 #include <sys/select.h>
 #endif
@@ -50,9 +75,31 @@ using namespace gaige;
 namespace {
 // clang-format off
 class Engine;
+#include "aloy-history.inc"
+#include "aloy-writer.inc"
+#include "aloy-journal.inc"
+#include "aloy-pressure.inc"
+#include "aloy-cost.inc"
+#include "aloy-directives.inc"
+#include "aloy-discovery.inc"
+#include "aloy-watch.inc"
 #include "aloy-job.inc"
+#include "aloy-report.inc"
+#include "aloy-trace.inc"
+#include "aloy-remote.inc"
 #include "aloy-engine.inc"
+#include "aloy-history.inc"
+#include "aloy-writer.inc"
+#include "aloy-journal.inc"
+#include "aloy-pressure.inc"
+#include "aloy-cost.inc"
+#include "aloy-directives.inc"
+#include "aloy-discovery.inc"
+#include "aloy-watch.inc"
 #include "aloy-job.inc"
+#include "aloy-report.inc"
+#include "aloy-trace.inc"
+#include "aloy-remote.inc"
 #include "aloy-engine.inc"
 // clang-format on
 } // namespace
@@ -70,11 +117,36 @@ int main (int argc, char *argv[]) {
     bool help = false;
     bool version = false;
     bool verbose = false;
-    unsigned jobs = 0;
+    char const *jobs = nullptr;
+    unsigned workers = 0;
+    unsigned buffer = 1024;
+    unsigned top = 5;
+    unsigned retry = 0;
+    bool fail_first = false;
+    unsigned fail_fast = 0;
+    unsigned timeout = 0;
+    bool costs = false;
+    char const *memory = nullptr;
     char const *tester = "kratos";
     std::vector<std::string> gen;
     char const *out = "";
     char const *dir = nullptr;
+    char const *cache = nullptr;
+    char const *jsonl = nullptr;
+    char const *junit = nullptr;
+    char const *trace = nullptr;
+    char const *serve = nullptr;
+    char const *connect = nullptr;
+    char const *shard = nullptr;
+    char const *rerun = nullptr;
+    char const *find = nullptr;
+    char const *source = nullptr;
+    char const *filter = nullptr;
+    std::vector<char const *> tags;
+    bool watch = false;
+    bool unordered = false;
+    bool resume = false;
+    bool compress = false;
   } flags;
   static constinit nms::Option const options[]
       = {{"help", 'h', OPTION_FLDFN(Flags, help), "Help"},
@@ -82,10 +154,49 @@ int main (int argc, char *argv[]) {
          {"verbose", 'v', OPTION_FLDFN(Flags, verbose), "Verbose"},
          {"dir", 'C', OPTION_FLDFN(Flags, dir), "DIR:Set directory"},
          {"jobs", 'j', nms::Option::F_IsConcatenated,
-          OPTION_FLDFN(Flags, jobs), "N:Concurrency"},
+          OPTION_FLDFN(Flags, jobs), "N|auto:Concurrency"},
          {"out", 'o', OPTION_FLDFN(Flags, out), "FILE:Output"},
          {"gen", 'g', OPTION_FLDFN(Flags, gen), "PROGRAM:Generator"},
          {"tester", 't', OPTION_FLDFN(Flags, tester), "PROGRAM:Tester"},
+         {"workers", 'w', OPTION_FLDFN(Flags, workers),
+          "N:Persistent testers"},
+         {"cache", 'c', OPTION_FLDFN(Flags, cache), "DIR:Result cache"},
+         {"buffer", 'b', OPTION_FLDFN(Flags, buffer),
+          "KB:Job output held in memory"},
+         {"top", 0, OPTION_FLDFN(Flags, top), "N:Costliest tests listed"},
+         {"retry", 0, OPTION_FLDFN(Flags, retry), "N:Retry failed tests"},
+         {"fail-first", 0, OPTION_FLDFN(Flags, fail_first),
+          "Run recent failures first"},
+         {"fail-fast", 0, OPTION_FLDFN(Flags, fail_fast),
+          "N:Stop after N failures"},
+         {"timeout", 0, OPTION_FLDFN(Flags, timeout),
+          "SECS:Wall clock limit per test"},
+         {"costs", 0, OPTION_FLDFN(Flags, costs), "Admit tests by cost"},
+         {"memory", 0, OPTION_FLDFN(Flags, memory),
+          "SIZE:Memory budget, implies --costs"},
+         {"jsonl", 0, OPTION_FLDFN(Flags, jsonl), "FILE:JSON Lines results"},
+         {"junit", 0, OPTION_FLDFN(Flags, junit), "FILE:JUnit XML results"},
+         {"trace", 0, OPTION_FLDFN(Flags, trace), "FILE:Timeline trace"},
+         {"serve", 0, OPTION_FLDFN(Flags, serve),
+          "ADDR:Coordinate remote workers"},
+         {"connect", 0, OPTION_FLDFN(Flags, connect),
+          "ADDR:Work for a coordinator"},
+         {"shard", 0, OPTION_FLDFN(Flags, shard), "I/N:Run one shard of N"},
+         {"rerun", 'r', OPTION_FLDFN(Flags, rerun),
+          "SUMFILE:Rerun its failed tests"},
+         {"find", 'f', OPTION_FLDFN(Flags, find), "DIR:Find tests"},
+         {"source", 's', OPTION_FLDFN(Flags, source),
+          "DIR:Test files' directory"},
+         {"filter", 0, OPTION_FLDFN(Flags, filter),
+          "REGEX:Select matching tests"},
+         {"tag", 0, OPTION_FLDFN(Flags, tags), "TAG:Select tagged tests"},
+         {"watch", 0, OPTION_FLDFN(Flags, watch), "Rerun tests on change"},
+         {"unordered", 0, OPTION_FLDFN(Flags, unordered),
+          "Retire tests as they complete"},
+         {"resume", 0, OPTION_FLDFN(Flags, resume),
+          "Resume an interrupted run"},
+         {"compress", 'z', OPTION_FLDFN(Flags, compress),
+          "Compress the log, indexed by test"},
          {}};
   int argno = options->parseArgs(argc, argv, &flags);
   if (flags.help) {
@@ -102,63 +213,192 @@ int main (int argc, char *argv[]) {
     if (chdir(flags.dir) < 0)
       fatalExit("?cannot chdir '%s': %m", flags.dir);
 
-  // Get the log streams
-  std::ofstream sum, log;
+  // Get the log streams, the engine gives them buffers for files
+  std::ostream sum(nullptr), log(nullptr);
+  int log_fd = 2, sum_fd = -1;
   if (!flags.out[flags.out[0] == '-'])
     flags.out = nullptr;
-  else {
+  if (flags.resume && !flags.out)
+    fatalExit("cannot resume without an output file");
+  if (flags.resume && flags.unordered)
+    fatalExit("cannot both resume and retire unordered");
+  if (flags.compress && !flags.out)
+    fatalExit("cannot compress the log without an output file");
+  if (flags.compress && flags.unordered)
+    fatalExit("cannot both compress the log and retire unordered");
+  if (flags.out) {
     std::string out(flags.out);
     size_t len = out.size();
+    // When resuming, the journal says how much to keep.  Reordering
+    // reads them too.
+    int mode = O_RDWR | O_CREAT | (flags.resume ? 0 : O_TRUNC) | O_CLOEXEC;
     out.append(".sum");
-    sum.open(out);
-    if (!sum.is_open())
+    sum_fd = open(out.c_str(), mode, 0666);
+    if (sum_fd < 0)
       fatalExit("cannot write '%s': %m", out.c_str());
-    out.erase(len).append(".log");
-    log.open(out);
-    if (!log.is_open())
+    out.erase(len).append(flags.compress ? ".logz" : ".log");
+    log_fd = open(out.c_str(), mode, 0666);
+    if (log_fd < 0)
       fatalExit("cannot write '%s': %m", out.c_str());
   }
 
-  Engine engine(std::min(flags.jobs, 256u), flags.out ? sum : std::cout,
+  // A fixed limit, adaptive, or from the jobserver
+  bool adaptive = flags.jobs && !strcmp(flags.jobs, "auto");
+  unsigned jobs = 0;
+  if (adaptive)
+    jobs = 1;
+  else if (flags.jobs) {
+    char *end;
+    jobs = strtoul(flags.jobs, &end, 10);
+    if (*end || !*flags.jobs)
+      fatalExit("job limit '%s' is not a number or 'auto'", flags.jobs);
+  }
+
+  Engine engine(std::min(jobs, 256u), flags.out ? sum : std::cout,
                 flags.out ? log : std::cerr);
+  if (adaptive)
+    engine.adaptive();
 
+  engine.workers(std::min(flags.workers, 256u));
+  if (flags.out) {
+    engine.history(std::string(flags.out) + ".hist");
+    engine.flakes(std::string(flags.out) + ".flake");
+    engine.failures(std::string(flags.out) + ".fail");
+  }
+  engine.retries(flags.retry);
+  if (flags.fail_first || flags.fail_fast)
+    engine.failFirst();
+  engine.failFast(flags.fail_fast);
+  engine.timeLimit(flags.timeout);
+  if (flags.costs || flags.memory) {
+    unsigned long kb = 0;
+    if (flags.memory && (!Cost::parseSize(flags.memory, kb) || !kb))
+      fatalExit("memory budget '%s' is not a size", flags.memory);
+    engine.costs(kb);
+  }
+  engine.cache(flags.cache);
+  engine.outputCap(size_t(flags.buffer) * 1024, log_fd);
+  engine.top(flags.top);
+  if (flags.compress)
+    engine.compress(std::string(flags.out) + ".logz.idx");
+  if (flags.unordered)
+    engine.unordered(sum_fd);
+  else if (flags.out) {
+    std::string journal(flags.out);
+    journal.append(".journal");
+    if (!engine.journal(std::move(journal), sum_fd, flags.resume))
+      fatalExit("cannot %s '%s.journal': %m",
+                flags.resume ? "resume from" : "write", flags.out);
+  }
+  if (flags.out && !engine.output(sum_fd, log_fd))
+    fatalExit("cannot write '%s.logz': %m", flags.out);
+  if (flags.shard) {
+    unsigned index, count;
+    char extra;
+    if (sscanf(flags.shard, "%u/%u%c", &index, &count, &extra) != 2
+        || !index || index > count)
+      fatalExit("shard '%s' is not INDEX/COUNT", flags.shard);
+    engine.shard(index, count);
+  }
+  if (flags.rerun && !engine.rerun(flags.rerun))
+    fatalExit("cannot read '%s': %m", flags.rerun);
+  if (flags.find) {
+    if (!flags.gen.empty())
+      fatalExit("cannot both find and generate tests");
+    if (!engine.find(flags.find))
+      fatalExit("cannot find tests in '%s': %m", flags.find);
+  }
+  if (flags.source && !engine.source(flags.source))
+    fatalExit("cannot read tests in '%s': %m", flags.source);
+  if (flags.filter)
+    if (char const *error = engine.filter(flags.filter))
+      fatalExit("invalid filter '%s': %s", flags.filter, error);
+  for (auto tag : flags.tags)
+    engine.tag(tag);
+  if (flags.watch && !engine.watchFiles())
+    fatalExit("cannot watch files: %m");
+  if (flags.jsonl && !engine.report(Report::JSONL, flags.jsonl))
+    fatalExit("cannot write '%s': %m", flags.jsonl);
+  if (flags.junit && !engine.report(Report::JUNIT, flags.junit))
+    fatalExit("cannot write '%s': %m", flags.junit);
+  if (flags.trace && !engine.trace(flags.trace))
+    fatalExit("cannot write '%s': %m", flags.trace);
+  int serve_fd = -1, connect_fd = -1;
+  char const *secret = getenv("ALOY_SECRET");
+  if (secret && *secret)
+    engine.secret(secret);
+  else
+    secret = nullptr;
+  if (flags.serve) {
+    if (flags.connect)
+      fatalExit("cannot both serve and connect");
+    if (char const *error = Remote::open(flags.serve, true, serve_fd))
+      fatalExit("cannot serve on '%s': %s", flags.serve, error);
+    if (!secret && !Remote::isLocal(serve_fd))
+      fatalExit("cannot serve beyond this machine on '%s' without"
+                " ALOY_SECRET",
+                flags.serve);
+    engine.serve(serve_fd);
+  }
+  if (flags.connect) {
+    // The coordinator chooses the tests
+    if (!flags.gen.empty() || flags.find || flags.rerun || flags.filter
+        || !flags.tags.empty() || flags.shard || flags.unordered
+        || flags.watch)
+      fatalExit("cannot select tests when connected to a coordinator");
+    if (char const *error = Remote::open(flags.connect, false, connect_fd))
+      fatalExit("cannot connect to '%s': %s", flags.connect, error);
+    engine.connect(connect_fd);
+  }
   engine.init(flags.tester, flags.gen.empty() ? nullptr : &flags.gen,
               argc - argno, argv + argno);
   bool show_progress = flags.out && isatty(1);
   size_t progress_size = 0;
 
-  // MainLoop
-  while (engine.isLive()) {
-    engine.spawn();
-    engine.process();
-    engine.retire(flags.out ? &std::cout : nullptr);
-    if (show_progress) {
-      std::string text = engine.getProgress();
-      auto text_size = text.size();
+  // MainLoop, repeated for each round of watch mode
+  do {
+    while (engine.isLive()) {
+      engine.spawn();
+      engine.process();
+      engine.retire(flags.out ? &std::cout : nullptr);
+      if (show_progress) {
+        std::string text = engine.getProgress();
+        auto text_size = text.size();
 
-      // Append spaces to rub out previous longer progress
-      if (text_size < progress_size)
-        text.append(progress_size - text_size, ' ');
+        // Append spaces to rub out previous longer progress
+        if (text_size < progress_size)
+          text.append(progress_size - text_size, ' ');
 
-      // Append backspaces so the cursor remains at the start of
-      // the progress.
-      text.append(text.size(), '\b');
-      write(1, text.data(), text.size());
-      progress_size = text_size;
+        // Append backspaces so the cursor remains at the start of
+        // the progress.
+        text.append(text.size(), '\b');
+        write(1, text.data(), text.size());
+        progress_size = text_size;
+      }
     }
-  }
 
-  if (show_progress) {
-    std::string text;
-    text.append(progress_size, ' ');
-    text.append(progress_size, '\b');
-    write(1, text.data(), text.size());
-  }
+    if (show_progress) {
+      std::string text;
+      text.append(progress_size, ' ');
+      text.append(progress_size, '\b');
+      write(1, text.data(), text.size());
+      progress_size = 0;
+    }
+  } while (engine.await(flags.out ? &std::cout : nullptr));
 
   engine.fini(flags.out ? &std::cout : nullptr);
 
-  sum.close();
-  log.close();
+  if (flags.out)
+    close(log_fd);
+  if (sum_fd >= 0)
+    close(sum_fd);
+  if (serve_fd >= 0) {
+    close(serve_fd);
+    if (!strncmp(flags.serve, "unix:", 5))
+      unlink(flags.serve + 5);
+  }
+  if (connect_fd >= 0)
+    close(connect_fd);
 
   return 0;
 }
@@ -0,0 +1,195 @@
+// Joust/KRATOS: Kapture Run And Test Output Safely	-*- mode:c++ -*-
+// Copyright (C) 2020-2024 Nathan Sidwell, nathan@acm.org
+// License: Affero GPL v3.0
+
+// Preloaded into the programs of a test kratos is caching, to record
+// the files they open.  Each process appends lines to the file named
+// by KRATOS_DEPS: '+PATH' for a file it read, '-PATH' for one it
+// looked for and didn't find, and 'wPATH' for one it wrote.  Its
+// program and shared objects are read files too.  Programs that make
+// system calls directly, or are statically linked, go unrecorded.
+
+// C++
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+// OS
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+char const *Deps = nullptr;
+
+// Append a line noting PATH, relative to DIR_FD, as KIND.  The file
+// is opened afresh each time, so the program can't disturb it, and
+// written in one go, so concurrent processes' lines don't interleave.
+
+void note (char kind, int dir_fd, char const *path) {
+  if (!Deps || !path || !*path)
+    return;
+
+  int err = errno;
+  char line[PATH_MAX * 2 + 2];
+  size_t len = 0;
+  line[len++] = kind;
+  if (path[0] != '/') {
+    ssize_t dir_len = -1;
+    if (dir_fd == AT_FDCWD) {
+      if (getcwd(line + len, PATH_MAX))
+        dir_len = strlen(line + len);
+    } else {
+      char link[32];
+      snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+      dir_len = readlink(link, line + len, PATH_MAX);
+    }
+    if (dir_len <= 0) {
+      errno = err;
+      return;
+    }
+    len += dir_len;
+    line[len++] = '/';
+  }
+  size_t path_len = strlen(path);
+  if (len + path_len < sizeof(line)) {
+    memcpy(line + len, path, path_len);
+    len += path_len;
+    line[len++] = '\n';
+    int fd = syscall(SYS_openat, AT_FDCWD, Deps,
+                     O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd >= 0) {
+      // There's nobody to tell of failure
+      [[maybe_unused]] ssize_t wrote = write(fd, line, len);
+      close(fd);
+    }
+  }
+  errno = err;
+}
+
+// Note the outcome FD of opening PATH with FLAGS
+
+void opened (int dir_fd, char const *path, int flags, int fd) {
+  if (flags & (O_DIRECTORY | O_PATH))
+    ;
+  else if ((flags & O_ACCMODE) != O_RDONLY || flags & (O_CREAT | O_TRUNC))
+    note('w', dir_fd, path);
+  else if (fd >= 0)
+    note('+', dir_fd, path);
+  else if (errno == ENOENT)
+    note('-', dir_fd, path);
+}
+
+void fopened (char const *path, char const *mode, FILE *file) {
+  if (mode[0] != 'r' || strchr(mode, '+'))
+    note('w', AT_FDCWD, path);
+  else if (file)
+    note('+', AT_FDCWD, path);
+  else if (errno == ENOENT)
+    note('-', AT_FDCWD, path);
+}
+
+int noteObject (dl_phdr_info *info, size_t, void *) {
+  // The program itself, and the vdso, have no path
+  if (info->dlpi_name[0] == '/')
+    note('+', AT_FDCWD, info->dlpi_name);
+
+  return 0;
+}
+
+__attribute__((constructor)) void init () {
+  Deps = getenv("KRATOS_DEPS");
+  if (!Deps)
+    return;
+
+  char exe[PATH_MAX];
+  ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (len > 0) {
+    exe[len] = 0;
+    note('+', AT_FDCWD, exe);
+  }
+  dl_iterate_phdr(noteObject, nullptr);
+}
+
+template <typename T>
+T *next (char const *name) {
+  return reinterpret_cast<T *>(dlsym(RTLD_NEXT, name));
+}
+
+// The mode is present only when creating a file
+
+mode_t modeArg (int flags, va_list args) {
+  return flags & (O_CREAT | O_TMPFILE) ? va_arg(args, mode_t) : 0;
+}
+
+} // namespace
+
+extern "C" {
+
+#define OPEN(NAME)                                                        \
+  int NAME (char const *path, int flags, ...) {                           \
+    static auto *real = next<int (char const *, int, ...)>(#NAME);        \
+    va_list args;                                                         \
+    va_start(args, flags);                                                \
+    mode_t mode = modeArg(flags, args);                                   \
+    va_end(args);                                                         \
+    int fd = real(path, flags, mode);                                     \
+    opened(AT_FDCWD, path, flags, fd);                                    \
+    return fd;                                                            \
+  }
+#define OPENAT(NAME)                                                      \
+  int NAME (int dir_fd, char const *path, int flags, ...) {               \
+    static auto *real = next<int (int, char const *, int, ...)>(#NAME);   \
+    va_list args;                                                         \
+    va_start(args, flags);                                                \
+    mode_t mode = modeArg(flags, args);                                   \
+    va_end(args);                                                         \
+    int fd = real(dir_fd, path, flags, mode);                             \
+    opened(dir_fd, path, flags, fd);                                      \
+    return fd;                                                            \
+  }
+// Fortified callers use these, when the flags aren't constant
+#define OPEN_2(NAME)                                                      \
+  int NAME (char const *path, int flags) {                                \
+    static auto *real = next<int (char const *, int)>(#NAME);             \
+    int fd = real(path, flags);                                           \
+    opened(AT_FDCWD, path, flags, fd);                                    \
+    return fd;                                                            \
+  }
+#define OPENAT_2(NAME)                                                    \
+  int NAME (int dir_fd, char const *path, int flags) {                    \
+    static auto *real = next<int (int, char const *, int)>(#NAME);        \
+    int fd = real(dir_fd, path, flags);                                   \
+    opened(dir_fd, path, flags, fd);                                      \
+    return fd;                                                            \
+  }
+#define FOPEN(NAME)                                                       \
+  FILE *NAME (char const *path, char const *mode) {                       \
+    static auto *real = next<FILE *(char const *, char const *)>(#NAME);  \
+    FILE *file = real(path, mode);                                        \
+    fopened(path, mode, file);                                            \
+    return file;                                                          \
+  }
+
+OPEN(open)
+OPEN(open64)
+OPENAT(openat)
+OPENAT(openat64)
+OPEN_2(__open_2)
+OPEN_2(__open64_2)
+OPENAT_2(__openat_2)
+OPENAT_2(__openat64_2)
+FOPEN(fopen)
+FOPEN(fopen64)
+
+#undef OPEN
+#undef OPENAT
+#undef OPEN_2
+#undef OPENAT_2
+#undef FOPEN
+}
@@ -24,9 +24,16 @@
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <string_view>
+#include <unordered_map>
+#include <vector>
 // C
+#include <climits>
+#include <cstdio>
 #include <cstring>
 // OS
 #include <fcntl.h>
@@ -40,6 +47,8 @@
 #include <sys/select.h>
 #endif
 #include <sys/fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 
@@ -60,12 +69,31 @@ using namespace gaige;
 // RUN-REQUIRE inside a loop would continue to the next iteration of
 // the loop.
 
+// Read back a captured output file
+static void readCapture (int fd, std::string &text) {
+  off_t size = lseek(fd, 0, SEEK_END);
+  text.resize(size);
+  for (off_t pos = 0; pos != size;) {
+    ssize_t got = pread(fd, text.data() + pos, size - pos, pos);
+    if (got <= 0) {
+      if (got < 0 && errno == EINTR)
+        continue;
+      // Truncated, the length must be honoured
+      std::fill(text.begin() + pos, text.end(), '\n');
+      break;
+    }
+    pos += got;
+  }
+}
+
 namespace {
 // clang-format off
 #include "kratos-command.inc"
+#include "kratos-cgroup.inc"
 #include "kratos-pipeline.inc"
 #include "kratos-command.inc"
 #include "kratos-parser.inc"
+#include "kratos-cache.inc"
 // clang-format on
 } // namespace
 
@@ -74,6 +102,198 @@ static void title (FILE *stream) {
   fprintf(stream, "Copyright 2020-2024 Nathan Sidwell, nathan@acm.org\n");
 }
 
+// Scan TESTFILE's RUN lines into PIPES, setting PATHNAME to where
+// it was found.  Return false if that failed.
+
+static bool parseTest (Symbols &syms, char const *testFile,
+                       std::vector<char const *> const &prefixes,
+                       std::vector<Pipeline> &pipes, std::string &pathname) {
+  bool ended = false;
+  {
+    pathname = syms.setOriginValues(testFile);
+    Parser parser(testFile, pipes, syms);
+
+    // Scan the pattern file
+    ended = parser.scanFile(pathname, prefixes);
+  }
+
+  return !((!ended && pipes.empty()) || Error::hasErrored());
+}
+
+// Execute the scanned PIPES, returning the exit code.  If there's a
+// CGROUP, tested commands run in children of it.
+
+static int runTest (Tester &logger, Symbols &syms, char const *testFile,
+                    std::vector<Pipeline> &pipes, bool verbose,
+                    CGroup *cgroup) {
+  if (verbose) {
+    logger.sum() << "Pipelines\n";
+    for (unsigned ix = 0; ix != pipes.size(); ix++)
+      logger.sum() << ix << pipes[ix];
+  }
+
+  unsigned limits[PL_PIDS + 1];
+
+  for (unsigned ix = PL_PIDS + 1; ix--;) {
+    static char const *const vars[PL_PIDS + 1]
+        = {"cpulimit", "memlimit", "filelimit", "timelimit", "pidlimit"};
+
+    // Default to 1 minute or 1 GB, and no pid limit
+    limits[ix] = ix == PL_CPU || ix == PL_HWM ? 60 : ix != PL_PIDS;
+    if (auto limit = syms.value(vars[ix])) {
+      Lexer lexer(*limit);
+
+      if (!lexer.isInteger() || lexer.peekChar())
+        logger.result(Tester::ERROR, testFile)
+            << "limit '" << vars[ix] << "=" << *limit << "' invalid";
+      else
+        limits[ix] = lexer.getToken()->integer();
+    }
+  }
+
+  if (pipes.empty())
+    logger.result(Tester::PASS, nms::SrcLoc(testFile)) << "No tests to test";
+
+  bool skipping = false;
+  for (auto &pipe : pipes) {
+    if (!skipping) {
+      logger.log() << '\n';
+      int e = pipe.execute(
+          logger, pipe.kind() < Pipeline::PIPE_HWM ? limits : nullptr, cgroup);
+      if (e == EINTR)
+        break;
+
+      if (e && pipe.kind() == Pipeline::REQUIRE)
+        skipping = true;
+    } else if (pipe.kind() != Pipeline::REQUIRE) {
+      pipe.result(logger, Tester::UNSUPPORTED);
+      skipping = false;
+    }
+  }
+
+  return Error::hasErrored();
+}
+
+static bool writeAll (int fd, std::string_view text) {
+  while (!text.empty()) {
+    ssize_t wrote = write(fd, text.data(), text.size());
+    if (wrote < 0) {
+      if (errno != EINTR)
+        return false;
+    } else
+      text.remove_prefix(wrote);
+  }
+
+  return true;
+}
+
+// Run TEST with fds 1 & 2 redirected to anonymous files, whose
+// contents are returned in TEXTS.  If there's a CACHE, a result for
+// unchanged inputs is replayed from there.  Returns the exit code.
+
+static int captureTest (Symbols const &defs, char const *test,
+                        std::vector<char const *> const &prefixes,
+                        bool verbose, Cache *cache, CGroup *cgroup,
+                        std::string texts[2]) {
+  int saved[2] = {fcntl(1, F_DUPFD_CLOEXEC, 3), fcntl(2, F_DUPFD_CLOEXEC, 3)};
+  int capture[2] = {makeTemp("sum"), makeTemp("log")};
+  if (saved[0] < 0 || saved[1] < 0 || capture[0] < 0 || capture[1] < 0)
+    fatalExit("?cannot capture output: %m");
+  dup2(capture[0], 1);
+  dup2(capture[1], 2);
+
+  Error::resetErrored();
+  int code = 1;
+  bool cached = false;
+  std::string key;
+  {
+    Symbols syms(&defs);
+    std::vector<Pipeline> pipes;
+    std::string pathname;
+
+    if (!parseTest(syms, test, prefixes, pipes, pathname))
+      std::cerr << "failed to construct commands '" << test << "'\n";
+    else {
+      if (cache) {
+        key = cache->key(pathname, syms, pipes);
+        cached = cache->lookup(key, code, texts);
+      }
+      if (!cached) {
+        Tester logger(std::cout, std::cerr);
+        if (cache)
+          cache->record();
+        code = runTest(logger, syms, test, pipes, verbose, cgroup);
+      }
+    }
+  }
+  std::cout.flush();
+  std::cerr.flush();
+  for (unsigned ix = 0; ix != 2; ix++) {
+    dup2(saved[ix], 1 + ix);
+    close(saved[ix]);
+    if (!cached)
+      readCapture(capture[ix], texts[ix]);
+    close(capture[ix]);
+  }
+
+  if (cached) {
+    std::string note(Tester::StatusNames[Tester::CACHED]);
+    note.append(": ").append(test).append(": ").append(key).append("\n");
+    for (unsigned ix = 0; ix != 2; ix++)
+      texts[ix].insert(0, note);
+  } else if (!key.empty())
+    cache->store(key, code, texts);
+
+  return code;
+}
+
+// Worker mode, used by aloy to avoid a fork & exec per test file.
+// Test file names are read from stdin, one per line.  Each test's
+// output is captured and returned on the original stdout as a frame
+// (see encodeFrame), with the resources its commands used.  Anything
+// written between tests goes to the original stderr.
+
+static int serveTests (Symbols const &defs,
+                       std::vector<char const *> const &prefixes,
+                       bool verbose, Cache *cache, CGroup *cgroup) {
+  int frame_fd = fcntl(1, F_DUPFD_CLOEXEC, 3);
+  if (frame_fd < 0)
+    fatalExit("?cannot duplicate output: %m");
+  dup2(2, 1);
+
+  for (std::string test; std::getline(std::cin, test);) {
+    if (test.empty())
+      continue;
+
+    rusage before, after;
+    getrusage(RUSAGE_CHILDREN, &before);
+    Pipeline::PeakRSS = 0;
+    std::string texts[2];
+    int code = captureTest(defs, test.c_str(), prefixes, verbose, cache,
+                           cgroup, texts);
+    getrusage(RUSAGE_CHILDREN, &after);
+
+    // Children's usage during this test.  Max RSS is not cumulative,
+    // so it is the largest of those reaped for it.
+    auto us = [] (timeval const &tv) {
+      return tv.tv_sec * 1000000l + tv.tv_usec;
+    };
+    std::string usage;
+    for (long field : {us(after.ru_utime) - us(before.ru_utime),
+                       us(after.ru_stime) - us(before.ru_stime),
+                       Pipeline::PeakRSS,
+                       after.ru_inblock - before.ru_inblock,
+                       after.ru_oublock - before.ru_oublock,
+                       after.ru_nvcsw - before.ru_nvcsw,
+                       after.ru_nivcsw - before.ru_nivcsw})
+      usage.append(" ").append(std::to_string(field));
+    if (!writeAll(frame_fd, encodeFrame(code, texts, usage)))
+      fatalExit("?cannot write result frame: %m");
+  }
+
+  return 0;
+}
+
 int main (int argc, char *argv[]) {
 #include "joust/project-ident.inc"
   nms::setBuildInfo(JOUST_PROJECT_IDENTS);
@@ -83,6 +303,9 @@ int main (int argc, char *argv[]) {
     bool help = false;
     bool version = false;
     bool verbose = false;
+    bool worker = false;
+    char const *cache = nullptr;
+    char const *cgroup = nullptr;
     std::vector<char const *> prefixes; // Pattern prefixes
     std::vector<char const *> defines;  // Var defines
     char const *include = nullptr;      // file of var defines
@@ -99,6 +322,9 @@ int main (int argc, char *argv[]) {
       {"defines", 'd', OPTION_FLDFN(Flags, include), "FILE:File of defines"},
       {"out", 'o', OPTION_FLDFN(Flags, out), "FILE:Output"},
       {"prefix", 'p', OPTION_FLDFN(Flags, prefixes), "PREFIX:Pattern prefix"},
+      {"worker", 0, OPTION_FLDFN(Flags, worker), "Read tests from stdin"},
+      {"cache", 0, OPTION_FLDFN(Flags, cache), "DIR:Result cache"},
+      {"cgroup", 0, OPTION_FLDFN(Flags, cgroup), "DIR:Delegated cgroup"},
       {}};
   int argno = options->parseArgs(argc, argv, &flags);
   if (flags.help) {
@@ -115,9 +341,11 @@ int main (int argc, char *argv[]) {
     if (chdir(flags.dir) < 0)
       fatalExit("?cannot chdir '%s': %m", flags.dir);
 
-  if (argno == argc)
+  if (flags.worker) {
+    if (argno != argc || flags.out[0])
+      fatalExit("?worker takes no test filename or output");
+  } else if (argno == argc)
     fatalExit("?expected test filename");
-  char const *testFile = argv[argno++];
 
   if (!flags.prefixes.size())
     flags.prefixes.push_back("RUN");
@@ -133,17 +361,36 @@ int main (int argc, char *argv[]) {
     if (*vars)
       syms.readFile(vars);
 
-  std::vector<Pipeline> pipes;
-  bool ended = false;
-  {
-    std::string pathname = syms.setOriginValues(testFile);
-    Parser parser(testFile, pipes, syms);
+  std::unique_ptr<Cache> cache;
+  if (flags.cache) {
+    cache.reset(new Cache(flags.cache));
+    if (!cache->isRecording()) {
+      std::cerr << "cannot find kratos-preload.so, not caching\n";
+      cache.reset();
+    }
+  }
 
-    // Scan the pattern file
-    ended = parser.scanFile(pathname, flags.prefixes);
+  std::unique_ptr<CGroup> cgroup;
+  if (flags.cgroup) {
+    cgroup.reset(new CGroup);
+    if (!cgroup->init(flags.cgroup)) {
+      std::cerr << "cgroup '" << flags.cgroup
+                << "' unusable, falling back to rlimits\n";
+      cgroup.reset();
+    }
   }
 
-  if ((!ended && pipes.empty()) || Error::hasErrored())
+  if (flags.worker)
+    return serveTests(syms, flags.prefixes, flags.verbose, cache.get(),
+                      cgroup.get());
+
+  char const *testFile = argv[argno++];
+  std::vector<Pipeline> pipes;
+  std::string pathname;
+  // A cached test is parsed afresh, in its own scope
+  Symbols scratch(&syms);
+  if (!parseTest(cache ? scratch : syms, testFile, flags.prefixes, pipes,
+                 pathname))
     fatalExit("?failed to construct commands '%s'", testFile);
 
   std::ofstream sum, log;
@@ -163,50 +410,15 @@ int main (int argc, char *argv[]) {
   }
 
   Tester logger(flags.out ? sum : std::cout, flags.out ? log : std::cerr);
-  if (flags.verbose) {
-    logger.sum() << "Pipelines\n";
-    for (unsigned ix = 0; ix != pipes.size(); ix++)
-      logger.sum() << ix << pipes[ix];
-  }
 
-  unsigned limits[PL_HWM + 1];
-
-  for (unsigned ix = PL_HWM + 1; ix--;) {
-    static char const *const vars[PL_HWM + 1]
-        = {"cpulimit", "memlimit", "filelimit", "timelimit"};
-
-    // Default to 1 minute or 1 GB
-    limits[ix] = ix == PL_CPU || ix == PL_HWM ? 60 : 1;
-    if (auto limit = syms.value(vars[ix])) {
-      Lexer lexer(*limit);
-
-      if (!lexer.isInteger() || lexer.peekChar())
-        logger.result(Tester::ERROR, testFile)
-            << "limit '" << vars[ix] << "=" << *limit << "' invalid";
-      else
-        limits[ix] = lexer.getToken()->integer();
-    }
-  }
-
-  if (pipes.empty())
-    logger.result(Tester::PASS, nms::SrcLoc(testFile)) << "No tests to test";
-
-  bool skipping = false;
-  for (auto &pipe : pipes) {
-    if (!skipping) {
-      logger.log() << '\n';
-      int e = pipe.execute(logger, pipe.kind() < Pipeline::PIPE_HWM ? limits
-                                                                    : nullptr);
-      if (e == EINTR)
-        break;
-
-      if (e && pipe.kind() == Pipeline::REQUIRE)
-        skipping = true;
-    } else if (pipe.kind() != Pipeline::REQUIRE) {
-      pipe.result(logger, Tester::UNSUPPORTED);
-      skipping = false;
-    }
+  if (cache) {
+    std::string texts[2];
+    int code = captureTest(syms, testFile, flags.prefixes, flags.verbose,
+                           cache.get(), cgroup.get(), texts);
+    logger.sum() << texts[0];
+    logger.log() << texts[1];
+    return code;
   }
 
-  return Error::hasErrored();
+  return runTest(logger, syms, testFile, pipes, flags.verbose, cgroup.get());
 }
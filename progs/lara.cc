@@ -0,0 +1,491 @@
+// Joust/LARA: Log And Result Aggregator		-*- mode:c++ -*-
+// Copyright (C) 2020-2024 Nathan Sidwell, nathan@acm.org
+// License: Affero GPL v3.0
+
+// LARA merges the .sum and .log outputs of several ALOY runs into a
+// single pair, ordered by test name.  The inputs are mapped, and
+// only an index of their tests is held in memory.  A compressed log
+// (aloy -z) is indexed by its frames, each unpacked as it's written,
+// or just one test's printed from it.
+
+#include "joust/cfg.h"
+// NMS
+#include "nms/fatal.hh"
+#include "nms/option.hh"
+// Gaige
+#include "gaige/logz.hh"
+// Joust
+#include "joust/tester.hh"
+// C++
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+// C
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+// OS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace nms;
+using namespace joust;
+using namespace gaige;
+
+namespace {
+
+// A read-only mapping of a file
+class Mapping {
+  void *Base = nullptr;
+  size_t Size = 0;
+
+public:
+  Mapping () = default;
+  ~Mapping () {
+    if (Base)
+      munmap(Base, Size);
+  }
+
+private:
+  Mapping (Mapping const &) = delete;
+  Mapping &operator= (Mapping const &) = delete;
+
+public:
+  bool map (std::string const &file);
+  std::string_view text () const {
+    return std::string_view(static_cast<char const *>(Base), Size);
+  }
+};
+
+bool Mapping::map (std::string const &file) {
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  struct stat stat;
+  bool ok = fstat(fd, &stat) >= 0;
+  if (ok && stat.st_size) {
+    Size = stat.st_size;
+    Base = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (Base == MAP_FAILED) {
+      Base = nullptr;
+      ok = false;
+    } else
+      madvise(Base, Size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  return ok;
+}
+
+class Merger : public Tester {
+  // An input's .sum and .log
+  struct Input {
+    std::string Stem;
+    Mapping Sum;
+    Mapping Log;
+    int LogZ = -1; // Or its compressed log
+
+    ~Input () {
+      if (LogZ >= 0)
+        close(LogZ);
+    }
+  };
+
+  // A test's text in one input
+  struct Entry {
+    unsigned Input = 0;
+    std::string_view Sum; // Its results
+    std::string_view Log; // Its log, after the '# Test:' line
+    off_t Frame = -1;     // Or its compressed log's frame
+    bool HasSum = false;
+    bool HasLog = false;
+  };
+
+private:
+  std::vector<std::unique_ptr<Input>> Inputs;
+  std::map<std::string, Entry, std::less<>> Tests;
+  unsigned Counts[STATUS_HWM] = {};
+  bool Update = false; // Later inputs replace earlier ones
+
+public:
+  Merger (std::ostream &sum, std::ostream &log)
+    : Tester(sum, log) {}
+
+public:
+  void update (bool update) { Update = update; }
+
+public:
+  auto result (Statuses status) {
+    Counts[status]++;
+    return Tester::result(status, nms::SrcLoc());
+  }
+
+public:
+  bool read (std::string const &stem);
+  void expect (std::string_view test);
+  void write ();
+
+private:
+  Entry *entry (std::string_view test, unsigned input, bool log);
+  void readSum (unsigned input);
+  void readLog (unsigned input);
+  int readLogZ (unsigned input);
+
+  friend std::ostream &operator<< (std::ostream &, Merger const &);
+};
+
+// Iterate over the lines of TEXT
+
+template <typename F>
+void forLines (std::string_view text, F f) {
+  for (auto sol = text.data(), end = sol + text.size(); sol != end;) {
+    auto eol = std::find(sol, end, '\n');
+    f(std::string_view(sol, eol), sol, eol + (eol != end));
+    sol = eol + (eol != end);
+  }
+}
+
+// Skip the 'Test run:' header, which ends at a blank line
+
+std::string_view skipHeader (std::string_view text) {
+  if (!text.starts_with("Test run:"))
+    return text;
+
+  auto blank = text.find("\n\n");
+  return text.substr(blank == text.npos ? text.size() : blank + 2);
+}
+
+bool Merger::read (std::string const &stem) {
+  auto &input = *Inputs.emplace_back(new Input);
+  input.Stem = stem;
+  if (!input.Sum.map(stem + ".sum"))
+    return false;
+  if (!input.Log.map(stem + ".log")) {
+    // Perhaps it's compressed
+    if (errno != ENOENT)
+      return false;
+    input.LogZ = open((stem + ".logz").c_str(), O_RDONLY | O_CLOEXEC);
+    if (input.LogZ < 0)
+      return false;
+  }
+
+  readSum(Inputs.size() - 1);
+  if (input.LogZ < 0)
+    readLog(Inputs.size() - 1);
+  else if (int err = readLogZ(Inputs.size() - 1)) {
+    errno = err;
+    return false;
+  }
+
+  return true;
+}
+
+// The entry for TEST from INPUT, or null if it is a duplicate.  When
+// updating, a later input's test replaces an earlier one's.
+
+Merger::Entry *Merger::entry (std::string_view test, unsigned input,
+                              bool log) {
+  auto iter = Tests.find(test);
+  if (iter == Tests.end())
+    iter = Tests.emplace(test, Entry{}).first;
+  auto &entry = iter->second;
+  if (entry.HasSum || entry.HasLog) {
+    if (Update && entry.Input != input) {
+      entry = Entry{};
+      entry.Input = input;
+    } else if (entry.Input != input || (log ? entry.HasLog : entry.HasSum)) {
+      // Once is enough, a log usually follows its results
+      if (!log || !entry.HasSum)
+        result(ERROR) << test << ": duplicate in " << Inputs[input]->Stem
+                      << " (first in " << Inputs[entry.Input]->Stem << ")";
+      return nullptr;
+    }
+  } else
+    entry.Input = input;
+
+  return &entry;
+}
+
+// A test's results end with aloy's '# USAGE: TEST ...' line.
+
+void Merger::readSum (unsigned input) {
+  static constexpr std::string_view usage = "# USAGE: ";
+  auto text = skipHeader(Inputs[input]->Sum.text());
+  auto begin = text.data();
+  forLines(text, [&] (std::string_view line, char const *sol,
+                      char const *next) {
+    if (!begin)
+      return;
+    if (line.starts_with("# Summary of ")) {
+      std::string_view rest(begin, sol);
+      if (rest.find_first_not_of('\n') != rest.npos)
+        result(ERROR) << Inputs[input]->Stem
+                      << ".sum: results without a test";
+      begin = nullptr;
+      return;
+    }
+    if (!line.starts_with(usage))
+      return;
+
+    auto test = line.substr(usage.size());
+    test = test.substr(0, test.find(' '));
+    if (auto *entry = this->entry(test, input, false)) {
+      entry->Sum = std::string_view(begin, next);
+      entry->HasSum = true;
+    }
+    begin = next;
+  });
+}
+
+// A test's log starts with a '# Test:N TEST' line.
+
+void Merger::readLog (unsigned input) {
+  static constexpr std::string_view header = "# Test:";
+  Entry *current = nullptr;
+  char const *begin = nullptr;
+  auto finish = [&] (char const *end) {
+    if (current)
+      current->Log = std::string_view(begin, end);
+    current = nullptr;
+  };
+
+  auto text = skipHeader(Inputs[input]->Log.text());
+  forLines(text, [&] (std::string_view line, char const *sol,
+                      char const *next) {
+    if (line.starts_with("# Test generator:")
+        || line.starts_with("# Summary of "))
+      finish(sol);
+    else if (line.starts_with(header)) {
+      finish(sol);
+      auto test = line.substr(header.size());
+      auto space = test.find(' ');
+      test.remove_prefix(space == test.npos ? test.size() : space + 1);
+      current = entry(test, input, true);
+      if (current)
+        current->HasLog = true;
+      begin = next;
+    }
+  });
+  finish(text.data() + text.size());
+}
+
+// A compressed log has a frame per test, starting with its '# Test:'
+// line.  Just note where they are.  Return errno.
+
+int Merger::readLogZ (unsigned input) {
+  std::vector<std::pair<std::string, off_t>> frames;
+  if (int err = indexLog(Inputs[input]->LogZ, frames))
+    return err;
+
+  for (auto const &[test, frame] : frames)
+    if (auto *entry = this->entry(test, input, true)) {
+      entry->Frame = frame;
+      entry->HasLog = true;
+    }
+
+  return 0;
+}
+
+// Note a test that should have been run
+
+void Merger::expect (std::string_view test) {
+  if (Tests.find(test) == Tests.end())
+    result(ERROR) << test << ": missing";
+}
+
+void Merger::write () {
+  unsigned ix = 0;
+  std::string unpacked;
+  for (auto const &[test, entry] : Tests) {
+    auto const &input = *Inputs[entry.Input];
+    auto const &stem = input.Stem;
+    if (!entry.HasSum)
+      result(ERROR) << test << ": no results in " << stem << ".sum";
+    if (!entry.HasLog)
+      result(ERROR) << test << ": no log in " << stem
+                    << (input.LogZ < 0 ? ".log" : ".logz");
+
+    forLines(entry.Sum, [&] (std::string_view line, char const *,
+                             char const *) {
+      Statuses st = decodeStatus(line);
+      if (isCounted(st))
+        Counts[st]++;
+    });
+    sum() << entry.Sum;
+    log() << "# Test:" << ix++ << ' ' << test << '\n';
+    if (entry.Frame < 0)
+      log() << entry.Log;
+    else {
+      // Only now unpack it, less its '# Test:' line
+      unpacked.clear();
+      if (int err = unpackFrame(input.LogZ, entry.Frame, unpacked)) {
+        errno = err;
+        fatalExit("cannot read '%s.logz': %m", stem.c_str());
+      }
+      auto eol = unpacked.find('\n');
+      log() << std::string_view(unpacked).substr(
+          eol == unpacked.npos ? unpacked.size() : eol + 1);
+    }
+  }
+
+  if (ix)
+    sum() << '\n';
+  *this << "# Summary of " << ix << " test programs \n" << *this;
+}
+
+std::ostream &operator<< (std::ostream &s, Merger const &self) {
+  for (unsigned ix = 0; ix != Tester::STATUS_HWM; ix++)
+    if (ix == Tester::PASS || self.Counts[ix])
+      s << self.StatusNames[ix] << ' ' << self.Counts[ix] << '\n';
+
+  return s;
+}
+
+} // namespace
+
+static void title (FILE *stream) {
+  fprintf(stream, "LARA: Log And Result Aggregator\n");
+  fprintf(stream, "Copyright 2020-2024 Nathan Sidwell, nathan@acm.org\n");
+}
+
+// Print TEST's log from STEM's compressed log, found via its index
+// (or by reading the frames, if there's none).  Return false if it's
+// not there.
+
+bool extract (char const *stem, char const *test) {
+  std::string file(stem);
+  file.append(".logz");
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    fatalExit("cannot read '%s': %m", file.c_str());
+  file.append(".idx");
+  int idx_fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+
+  std::string text;
+  int err = unpackTest(fd, idx_fd, test, text);
+  close(fd);
+  if (idx_fd >= 0)
+    close(idx_fd);
+  if (err == ENOENT)
+    return false;
+  if (err) {
+    errno = err;
+    fatalExit("cannot read '%s.logz': %m", stem);
+  }
+  fwrite(text.data(), 1, text.size(), stdout);
+
+  return true;
+}
+
+int main (int argc, char *argv[]) {
+#include "joust/project-ident.inc"
+  nms::setBuildInfo(JOUST_PROJECT_IDENTS);
+  nms::installSignalHandlers();
+
+  struct Flags {
+    bool help = false;
+    bool version = false;
+    bool update = false;
+    char const *expect = nullptr;
+    char const *out = "";
+    char const *dir = nullptr;
+    char const *extract = nullptr;
+  } flags;
+  static constinit nms::Option const options[] = {
+      {"help", 'h', OPTION_FLDFN(Flags, help), "Help"},
+      {"version", 0, OPTION_FLDFN(Flags, version), "Version"},
+      {"dir", 'C', OPTION_FLDFN(Flags, dir), "DIR:Set directory"},
+      {"expect", 'e', OPTION_FLDFN(Flags, expect), "FILE:Tests expected"},
+      {"update", 'u', OPTION_FLDFN(Flags, update),
+       "Later inputs replace earlier"},
+      {"out", 'o', OPTION_FLDFN(Flags, out), "FILE:Output"},
+      {"extract", 'x', OPTION_FLDFN(Flags, extract),
+       "TEST:Print its compressed log"},
+      {}};
+  int argno = options->parseArgs(argc, argv, &flags);
+  if (flags.help) {
+    title(stdout);
+    options->printUsage(stdout, "stems+");
+    return 0;
+  }
+  if (flags.version) {
+    title(stdout);
+    printBuildNote(stdout);
+    return 0;
+  }
+  if (flags.dir)
+    if (chdir(flags.dir) < 0)
+      fatalExit("cannot chdir '%s': %m", flags.dir);
+
+  if (flags.extract) {
+    // From the first input that has it
+    for (; argno != argc; argno++)
+      if (extract(argv[argno], flags.extract))
+        return 0;
+    fatalExit("no log of '%s' found", flags.extract);
+  }
+
+  std::ofstream sum, log;
+  if (!flags.out[flags.out[0] == '-'])
+    flags.out = nullptr;
+  else {
+    std::string out(flags.out);
+    size_t len = out.size();
+    out.append(".sum");
+    sum.open(out);
+    if (!sum.is_open())
+      fatalExit("cannot write '%s': %m", out.c_str());
+    out.erase(len).append(".log");
+    log.open(out);
+    if (!log.is_open())
+      fatalExit("cannot write '%s': %m", out.c_str());
+  }
+
+  Merger merger(flags.out ? sum : std::cout, flags.out ? log : std::cerr);
+  merger.update(flags.update);
+
+  auto now = time(nullptr);
+  merger << "Test run: " << ctime(&now);
+  merger << "Merged:";
+  for (int ix = argno; ix != argc; ix++)
+    merger << ' ' << argv[ix];
+  merger << "\n\n";
+
+  for (; argno != argc; argno++)
+    if (!merger.read(argv[argno]))
+      fatalExit("cannot read '%s': %m", argv[argno]);
+
+  if (flags.expect) {
+    // Test names, as the generator would give to aloy
+    std::ifstream in(flags.expect);
+    if (!in.is_open())
+      fatalExit("cannot read '%s': %m", flags.expect);
+    for (std::string line; std::getline(in, line);) {
+      std::string_view text(line);
+      for (size_t pos = 0;;) {
+        pos = text.find_first_not_of(' ', pos);
+        if (pos == text.npos || text[pos] == '#')
+          break;
+        auto end = std::min(text.find(' ', pos), text.size());
+        merger.expect(text.substr(pos, end - pos));
+        pos = end;
+      }
+    }
+  }
+
+  merger.write();
+
+  sum.close();
+  log.close();
+
+  return 0;
+}